@@ -1,5 +1,19 @@
+#include <algorithm>
+#include <cstdint>
 #include <cstring>
+#include <map>
+#include <mutex>
 #include <stdio.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <caml/alloc.h>
 #include <caml/bigarray.h>
@@ -7,6 +21,7 @@
 #include <caml/custom.h>
 #include <caml/memory.h>
 #include <caml/mlvalues.h>
+#include <caml/threads.h>
 
 #include <hb-ot.h>
 #include <hb.h>
@@ -35,10 +50,64 @@ extern "C" {
         CAMLreturn(error);
     }
 
+#define REHB_SHAPE_PLAN_CACHE_SIZE 8
+#define REHB_BUFFER_POOL_SIZE 4
+#define REHB_STACK_FEATURES 16
+/* Below this many bytes, copying the input and releasing the runtime
+   costs more than the shaping itself */
+#define REHB_RELEASE_RUNTIME_MIN_BYTES 256
+// Codepoints covered by the simple text fast path (Latin-1)
+#define REHB_SIMPLE_TEXT_SIZE 256
+
+    /* A shape plan, along with the (segment properties, feature set) it
+       was compiled for. The face is implied by the owning rehb_font. */
+    struct rehb_shape_plan_entry {
+        hb_shape_plan_t *plan;
+        hb_segment_properties_t props;
+        hb_feature_t *features;
+        unsigned int featuresLen;
+        unsigned int lastUsed;
+    };
+
+    /* Glyphs and advances of the Latin-1 range, for text that is known to
+       shape to exactly its nominal glyphs: [simple[c]] is set when no
+       default GSUB/GPOS lookup can touch the glyph of [c]. */
+    struct rehb_simple_text {
+        hb_codepoint_t glyphs[REHB_SIMPLE_TEXT_SIZE];
+        hb_position_t advances[REHB_SIMPLE_TEXT_SIZE];
+        bool simple[REHB_SIMPLE_TEXT_SIZE];
+    };
+
+    /* Backing storage of the [harfbuzz.font] custom block. The font is
+       immutable once created and can be shaped with from any thread; the
+       plan cache is guarded by [planLock]. */
+    struct rehb_font {
+        hb_font_t *font;
+        struct rehb_shape_plan_entry plans[REHB_SHAPE_PLAN_CACHE_SIZE];
+        unsigned int planClock;
+        std::mutex planLock;
+        // Set when loading tables calls back into OCaml, in which case
+        // the runtime must be held while shaping
+        bool needsRuntime;
+        // Built on first use; nullptr when the face can't use the fast path
+        std::once_flag simpleTextOnce;
+        struct rehb_simple_text *simpleText;
+    };
+
+#define Rehb_font_val(v) (*((struct rehb_font **)Data_custom_val(v)))
+
     static void custom_finalize_hb_font(value vFontBlock) {
-        hb_font_t *pFont = *((hb_font_t **)Data_custom_val(vFontBlock));
+        struct rehb_font *pFont = Rehb_font_val(vFontBlock);
         if (pFont) {
-            hb_font_destroy(pFont);
+            for (int i = 0; i < REHB_SHAPE_PLAN_CACHE_SIZE; i++) {
+                if (pFont->plans[i].plan) {
+                    hb_shape_plan_destroy(pFont->plans[i].plan);
+                    free(pFont->plans[i].features);
+                }
+            }
+            hb_font_destroy(pFont->font);
+            delete pFont->simpleText;
+            delete pFont;
         }
     }
 
@@ -54,6 +123,909 @@ extern "C" {
         custom_fixed_length_default
     };
 
+    // Wrap [font] in a [harfbuzz.font] custom block, taking ownership of it
+    static value alloc_font_block(hb_font_t *font, bool needsRuntime) {
+        CAMLparam0();
+        CAMLlocal1(custom_font_block);
+
+        hb_font_make_immutable(font);
+
+        struct rehb_font *pFont = new rehb_font();
+        pFont->font = font;
+        pFont->needsRuntime = needsRuntime;
+
+        custom_font_block =
+            caml_alloc_custom(&hb_font_custom_ops, sizeof(struct rehb_font *), 0, 1);
+        Rehb_font_val(custom_font_block) = pFont;
+        CAMLreturn(custom_font_block);
+    }
+
+    /* Shape plans are looked up by segment properties and the exact
+       user feature set; the least recently used entry is replaced.
+       Returns a new reference, since another thread may evict the entry
+       while the plan is executing. */
+    static hb_shape_plan_t *get_shape_plan(struct rehb_font *pFont,
+                                           const hb_segment_properties_t *props,
+                                           const hb_feature_t *features,
+                                           unsigned int featuresLen) {
+        std::lock_guard<std::mutex> guard(pFont->planLock);
+        struct rehb_shape_plan_entry *victim = &pFont->plans[0];
+        pFont->planClock++;
+
+        for (int i = 0; i < REHB_SHAPE_PLAN_CACHE_SIZE; i++) {
+            struct rehb_shape_plan_entry *entry = &pFont->plans[i];
+            if (entry->plan && entry->featuresLen == featuresLen &&
+                    hb_segment_properties_equal(&entry->props, props) &&
+                    (featuresLen == 0 ||
+                     std::memcmp(entry->features, features,
+                                 featuresLen * sizeof(hb_feature_t)) == 0)) {
+                entry->lastUsed = pFont->planClock;
+                return hb_shape_plan_reference(entry->plan);
+            }
+
+            if (!entry->plan) {
+                victim = entry;
+            } else if (victim->plan && entry->lastUsed < victim->lastUsed) {
+                victim = entry;
+            }
+        }
+
+        if (victim->plan) {
+            hb_shape_plan_destroy(victim->plan);
+            free(victim->features);
+        }
+
+        // Variation instances share the face, but GSUB/GPOS feature
+        // variations depend on their coordinates
+        unsigned int coordsLen = 0;
+        const int *coords =
+            hb_font_get_var_coords_normalized(pFont->font, &coordsLen);
+        victim->plan = hb_shape_plan_create_cached2(
+                           hb_font_get_face(pFont->font), props, features, featuresLen,
+                           coords, coordsLen, nullptr);
+        victim->props = *props;
+        victim->featuresLen = featuresLen;
+        victim->features = nullptr;
+        if (featuresLen > 0) {
+            victim->features =
+                (hb_feature_t *)malloc(featuresLen * sizeof(hb_feature_t));
+            std::memcpy(victim->features, features,
+                        featuresLen * sizeof(hb_feature_t));
+        }
+        victim->lastUsed = pFont->planClock;
+        return hb_shape_plan_reference(victim->plan);
+    }
+
+    /* hb_buffer_t pool - buffers are cleared, not destroyed, between calls
+       so their glyph storage is reused. */
+    static hb_buffer_t *buffer_pool[REHB_BUFFER_POOL_SIZE];
+    static int buffer_pool_count = 0;
+    static std::mutex buffer_pool_lock;
+
+    static hb_buffer_t *acquire_buffer() {
+        std::lock_guard<std::mutex> guard(buffer_pool_lock);
+        if (buffer_pool_count > 0) {
+            return buffer_pool[--buffer_pool_count];
+        }
+        return hb_buffer_create();
+    }
+
+    static void release_buffer(hb_buffer_t *buffer) {
+        std::lock_guard<std::mutex> guard(buffer_pool_lock);
+        if (buffer_pool_count < REHB_BUFFER_POOL_SIZE &&
+                hb_buffer_allocation_successful(buffer)) {
+            hb_buffer_clear_contents(buffer);
+            buffer_pool[buffer_pool_count++] = buffer;
+        } else {
+            hb_buffer_destroy(buffer);
+        }
+    }
+
+    /* User features, converted from OCaml without a heap allocation for the
+       common case of a handful of features. */
+    struct rehb_features {
+        hb_feature_t stack[REHB_STACK_FEATURES];
+        hb_feature_t *data;
+        unsigned int len;
+    };
+
+    // Convert an OCaml array of Harfbuzz.Internal.feature records
+    static void features_of_value(value vFeatures, struct rehb_features *out) {
+        unsigned int len = Wosize_val(vFeatures);
+        out->len = len;
+        out->data = len <= REHB_STACK_FEATURES
+                    ? out->stack
+                    : (hb_feature_t *)malloc(len * sizeof(hb_feature_t));
+        for (unsigned int i = 0; i < len; i++) {
+            value feat = Field(vFeatures, i);
+            const char *tag = String_val(Field(feat, 0));
+            out->data[i].tag = HB_TAG(tag[0], tag[1], tag[2], tag[3]);
+            out->data[i].value = Int_val(Field(feat, 1));
+            out->data[i].start = Int_val(Field(feat, 2));
+            out->data[i].end = Int_val(Field(feat, 3));
+        }
+    }
+
+    static void features_free(struct rehb_features *features) {
+        if (features->data != features->stack) {
+            free(features->data);
+        }
+    }
+
+    /* Itemization: the input is split into runs of a single script, each
+       shaped with explicit segment properties instead of guessing them for
+       the whole range. Common and inherited characters (spaces, punctuation,
+       digits, emoji, combining marks) join the surrounding run; leading ones
+       join the first run with a real script. */
+    struct rehb_run {
+        int start;
+        int length;
+        hb_script_t script;
+        hb_direction_t direction;
+        hb_language_t language;
+        // Bidi embedding level: even levels are left-to-right
+        unsigned char level;
+    };
+
+    // Decode the UTF-8 sequence at [str], storing its length in [size].
+    // Malformed input decodes to U+FFFD, one byte at a time.
+    static hb_codepoint_t decode_utf8(const unsigned char *str,
+                                      const unsigned char *end, int *size) {
+        unsigned char c = str[0];
+        int expected;
+        hb_codepoint_t codepoint;
+
+        if (c < 0x80) {
+            *size = 1;
+            return c;
+        } else if ((c & 0xE0) == 0xC0) {
+            expected = 2;
+            codepoint = c & 0x1F;
+        } else if ((c & 0xF0) == 0xE0) {
+            expected = 3;
+            codepoint = c & 0x0F;
+        } else if ((c & 0xF8) == 0xF0) {
+            expected = 4;
+            codepoint = c & 0x07;
+        } else {
+            *size = 1;
+            return 0xFFFD;
+        }
+
+        if (end - str < expected) {
+            *size = 1;
+            return 0xFFFD;
+        }
+        for (int i = 1; i < expected; i++) {
+            if ((str[i] & 0xC0) != 0x80) {
+                *size = 1;
+                return 0xFFFD;
+            }
+            codepoint = (codepoint << 6) | (str[i] & 0x3F);
+        }
+        *size = expected;
+        return codepoint;
+    }
+
+    static bool is_neutral_script(hb_script_t script) {
+        return script == HB_SCRIPT_COMMON || script == HB_SCRIPT_INHERITED ||
+               script == HB_SCRIPT_UNKNOWN;
+    }
+
+    /* Bidi classes of the Unicode Bidirectional Algorithm (UAX #9), less
+       the explicit embeddings and isolates, which are treated as boundary
+       neutrals. */
+    enum rehb_bidi_class {
+        BIDI_L,   // Left-to-right
+        BIDI_R,   // Right-to-left
+        BIDI_AL,  // Arabic letter
+        BIDI_EN,  // European number
+        BIDI_ES,  // European separator
+        BIDI_ET,  // European terminator
+        BIDI_AN,  // Arabic number
+        BIDI_CS,  // Common separator
+        BIDI_NSM, // Non-spacing mark
+        BIDI_BN,  // Boundary neutral
+        BIDI_B,   // Paragraph separator
+        BIDI_S,   // Segment separator
+        BIDI_WS,  // Whitespace
+        BIDI_ON,  // Other neutral
+    };
+
+    static bool in_range(hb_codepoint_t c, hb_codepoint_t first,
+                         hb_codepoint_t last) {
+        return c >= first && c <= last;
+    }
+
+    // Blocks of Arabic letters, and of other right-to-left scripts
+    static bool is_arabic_letter_block(hb_codepoint_t c) {
+        return in_range(c, 0x0600, 0x07BF) || in_range(c, 0x0860, 0x08FF) ||
+               in_range(c, 0xFB50, 0xFDFF) || in_range(c, 0xFE70, 0xFEFF) ||
+               in_range(c, 0x10D00, 0x10D3F) || in_range(c, 0x10F30, 0x10F6F) ||
+               in_range(c, 0x1EC70, 0x1ECBF) || in_range(c, 0x1ED00, 0x1ED4F) ||
+               in_range(c, 0x1EE00, 0x1EEFF);
+    }
+
+    static bool is_right_to_left_block(hb_codepoint_t c) {
+        return in_range(c, 0x0590, 0x05FF) || in_range(c, 0x07C0, 0x085F) ||
+               in_range(c, 0xFB1D, 0xFB4F) || in_range(c, 0x10800, 0x10FFF) ||
+               in_range(c, 0x1E800, 0x1EFFF);
+    }
+
+    // The bidi class of [c], from its general category and block: a table
+    // of the classes that matter for runs, not the full UCD property
+    static rehb_bidi_class bidi_class_of(hb_unicode_funcs_t *ufuncs,
+                                         hb_codepoint_t c) {
+        if (c < 0x80) {
+            if (c >= '0' && c <= '9') {
+                return BIDI_EN;
+            }
+            switch (c) {
+            case '+':
+            case '-':
+                return BIDI_ES;
+            case '#':
+            case '$':
+            case '%':
+                return BIDI_ET;
+            case ',':
+            case '.':
+            case '/':
+            case ':':
+                return BIDI_CS;
+            case '\n':
+            case '\r':
+            case 0x1C:
+            case 0x1D:
+            case 0x1E:
+                return BIDI_B;
+            case '\t':
+            case 0x0B:
+            case 0x1F:
+                return BIDI_S;
+            case ' ':
+            case 0x0C:
+                return BIDI_WS;
+            }
+            if (c < 0x20 || c == 0x7F) {
+                return BIDI_BN;
+            }
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+                return BIDI_L;
+            }
+            return BIDI_ON;
+        }
+
+        switch (c) {
+        case 0x0085:
+        case 0x2029:
+            return BIDI_B;
+        case 0x00A0:
+        case 0x060C:
+        case 0x202F:
+        case 0x2044:
+            return BIDI_CS;
+        case 0x066B:
+        case 0x066C:
+            return BIDI_AN;
+        case 0x00B0:
+        case 0x00B1:
+        case 0x066A:
+            return BIDI_ET;
+        case 0x200E: // Left-to-right mark
+            return BIDI_L;
+        case 0x200F: // Right-to-left mark
+            return BIDI_R;
+        case 0x061C: // Arabic letter mark
+            return BIDI_AL;
+        }
+
+        switch (hb_unicode_general_category(ufuncs, c)) {
+        case HB_UNICODE_GENERAL_CATEGORY_NON_SPACING_MARK:
+        case HB_UNICODE_GENERAL_CATEGORY_ENCLOSING_MARK:
+            return BIDI_NSM;
+        case HB_UNICODE_GENERAL_CATEGORY_CONTROL:
+        case HB_UNICODE_GENERAL_CATEGORY_FORMAT:
+            return BIDI_BN;
+        case HB_UNICODE_GENERAL_CATEGORY_SPACE_SEPARATOR:
+        case HB_UNICODE_GENERAL_CATEGORY_LINE_SEPARATOR:
+            return BIDI_WS;
+        case HB_UNICODE_GENERAL_CATEGORY_PARAGRAPH_SEPARATOR:
+            return BIDI_B;
+        case HB_UNICODE_GENERAL_CATEGORY_DECIMAL_NUMBER:
+            if (in_range(c, 0x0660, 0x0669) || in_range(c, 0x10D30, 0x10D39)) {
+                return BIDI_AN;
+            }
+            if (is_right_to_left_block(c)) {
+                return BIDI_R;
+            }
+            return BIDI_EN;
+        case HB_UNICODE_GENERAL_CATEGORY_CURRENCY_SYMBOL:
+            return BIDI_ET;
+        default:
+            break;
+        }
+
+        if (is_arabic_letter_block(c)) {
+            return BIDI_AL;
+        }
+        if (is_right_to_left_block(c)) {
+            return BIDI_R;
+        }
+
+        switch (hb_unicode_general_category(ufuncs, c)) {
+        case HB_UNICODE_GENERAL_CATEGORY_CONNECT_PUNCTUATION:
+        case HB_UNICODE_GENERAL_CATEGORY_DASH_PUNCTUATION:
+        case HB_UNICODE_GENERAL_CATEGORY_CLOSE_PUNCTUATION:
+        case HB_UNICODE_GENERAL_CATEGORY_FINAL_PUNCTUATION:
+        case HB_UNICODE_GENERAL_CATEGORY_INITIAL_PUNCTUATION:
+        case HB_UNICODE_GENERAL_CATEGORY_OTHER_PUNCTUATION:
+        case HB_UNICODE_GENERAL_CATEGORY_OPEN_PUNCTUATION:
+        case HB_UNICODE_GENERAL_CATEGORY_MODIFIER_SYMBOL:
+        case HB_UNICODE_GENERAL_CATEGORY_MATH_SYMBOL:
+        case HB_UNICODE_GENERAL_CATEGORY_OTHER_SYMBOL:
+            return BIDI_ON;
+        default:
+            return BIDI_L;
+        }
+    }
+
+    static bool is_strong_right_to_left(rehb_bidi_class cls) {
+        return cls == BIDI_R || cls == BIDI_AL;
+    }
+
+    static bool is_bidi_neutral(rehb_bidi_class cls) {
+        return cls == BIDI_B || cls == BIDI_S || cls == BIDI_WS ||
+               cls == BIDI_ON || cls == BIDI_BN;
+    }
+
+    /* Resolve the embedding level of each character of a paragraph with
+       the implicit rules of UAX #9: the paragraph level from its first
+       strong character (P2, P3), weak types (W1-W7), neutrals (N1, N2),
+       implicit levels (I1, I2) and trailing whitespace (L1). */
+    static unsigned char resolve_bidi_levels(std::vector<rehb_bidi_class> &types,
+                                             std::vector<unsigned char> &levels) {
+        size_t count = types.size();
+        std::vector<rehb_bidi_class> original(types);
+
+        unsigned char paragraphLevel = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (types[i] == BIDI_L) {
+                break;
+            }
+            if (is_strong_right_to_left(types[i])) {
+                paragraphLevel = 1;
+                break;
+            }
+        }
+        rehb_bidi_class sos = paragraphLevel ? BIDI_R : BIDI_L;
+
+        // W1: marks take the type of the character before them
+        rehb_bidi_class previous = sos;
+        for (size_t i = 0; i < count; i++) {
+            if (types[i] == BIDI_NSM) {
+                types[i] = previous;
+            } else if (types[i] != BIDI_BN) {
+                previous = types[i];
+            }
+        }
+
+        // W2, W3: numbers after Arabic letters are Arabic numbers, and
+        // Arabic letters are right-to-left
+        rehb_bidi_class lastStrong = sos;
+        for (size_t i = 0; i < count; i++) {
+            if (types[i] == BIDI_EN && lastStrong == BIDI_AL) {
+                types[i] = BIDI_AN;
+            } else if (types[i] == BIDI_L || types[i] == BIDI_R ||
+                       types[i] == BIDI_AL) {
+                lastStrong = types[i];
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (types[i] == BIDI_AL) {
+                types[i] = BIDI_R;
+            }
+        }
+
+        // W4: a single separator between two numbers of the same kind
+        for (size_t i = 1; i + 1 < count; i++) {
+            if (types[i - 1] != types[i + 1]) {
+                continue;
+            }
+            if (types[i] == BIDI_ES && types[i - 1] == BIDI_EN) {
+                types[i] = BIDI_EN;
+            } else if (types[i] == BIDI_CS && (types[i - 1] == BIDI_EN ||
+                                               types[i - 1] == BIDI_AN)) {
+                types[i] = types[i - 1];
+            }
+        }
+
+        // W5: terminators next to European numbers
+        for (size_t i = 0; i < count;) {
+            if (types[i] != BIDI_ET) {
+                i++;
+                continue;
+            }
+            size_t end = i;
+            while (end < count && types[end] == BIDI_ET) {
+                end++;
+            }
+            bool nextToNumber = (i > 0 && types[i - 1] == BIDI_EN) ||
+                                (end < count && types[end] == BIDI_EN);
+            if (nextToNumber) {
+                for (size_t j = i; j < end; j++) {
+                    types[j] = BIDI_EN;
+                }
+            }
+            i = end;
+        }
+
+        // W6: other separators and terminators are neutral
+        for (size_t i = 0; i < count; i++) {
+            if (types[i] == BIDI_ES || types[i] == BIDI_ET ||
+                    types[i] == BIDI_CS) {
+                types[i] = BIDI_ON;
+            }
+        }
+
+        // W7: European numbers in left-to-right context
+        lastStrong = sos;
+        for (size_t i = 0; i < count; i++) {
+            if (types[i] == BIDI_EN && lastStrong == BIDI_L) {
+                types[i] = BIDI_L;
+            } else if (types[i] == BIDI_L || types[i] == BIDI_R) {
+                lastStrong = types[i];
+            }
+        }
+
+        // N1, N2: neutrals between text of one direction take it (numbers
+        // count as right-to-left), others the paragraph's
+        for (size_t i = 0; i < count;) {
+            if (!is_bidi_neutral(types[i])) {
+                i++;
+                continue;
+            }
+            size_t end = i;
+            while (end < count && is_bidi_neutral(types[end])) {
+                end++;
+            }
+            auto strength = [](rehb_bidi_class cls) {
+                return cls == BIDI_L ? BIDI_L : BIDI_R;
+            };
+            rehb_bidi_class before = i > 0 ? strength(types[i - 1]) : sos;
+            rehb_bidi_class after = end < count ? strength(types[end]) : sos;
+            rehb_bidi_class resolved = before == after ? before : sos;
+            for (size_t j = i; j < end; j++) {
+                types[j] = resolved;
+            }
+            i = end;
+        }
+
+        // I1, I2
+        levels.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            unsigned char level = paragraphLevel;
+            if (paragraphLevel % 2 == 0) {
+                if (types[i] == BIDI_R) {
+                    level += 1;
+                } else if (types[i] == BIDI_AN || types[i] == BIDI_EN) {
+                    level += 2;
+                }
+            } else if (types[i] != BIDI_R) {
+                level += 1;
+            }
+            levels[i] = level;
+        }
+
+        // L1: separators, and whitespace before them or at the end, are at
+        // the paragraph level
+        bool trailing = true;
+        for (size_t i = count; i-- > 0;) {
+            rehb_bidi_class cls = original[i];
+            if (cls == BIDI_B || cls == BIDI_S) {
+                levels[i] = paragraphLevel;
+                trailing = true;
+            } else if (trailing && (cls == BIDI_WS || cls == BIDI_BN)) {
+                levels[i] = paragraphLevel;
+            } else {
+                trailing = false;
+            }
+        }
+
+        return paragraphLevel;
+    }
+
+    /* Split [len] bytes of [str] from [start] into runs of a single script
+       and bidi level, in logical order. A negative [len] means up to the
+       end of the (NUL-terminated) string, as with hb_buffer_add_utf8. The
+       range is resolved as one paragraph. Every run has the default
+       language: HarfBuzz only applies its lookups where the font has them
+       for the run's script. */
+    static void itemize_utf8(const char *str, int start, int len,
+                             std::vector<struct rehb_run> &runs) {
+        if (len < 0) {
+            len = (int)strlen(str + start);
+        }
+
+        hb_unicode_funcs_t *ufuncs = hb_unicode_funcs_get_default();
+        const unsigned char *text = (const unsigned char *)str;
+        const unsigned char *end = text + start + len;
+
+        std::vector<int> offsets;
+        std::vector<hb_script_t> scripts;
+        std::vector<rehb_bidi_class> types;
+        int pos = start;
+        while (pos < start + len) {
+            int size;
+            hb_codepoint_t codepoint = decode_utf8(text + pos, end, &size);
+            offsets.push_back(pos);
+            scripts.push_back(hb_unicode_script(ufuncs, codepoint));
+            types.push_back(bidi_class_of(ufuncs, codepoint));
+            pos += size;
+        }
+        size_t count = offsets.size();
+        if (count == 0) {
+            return;
+        }
+
+        std::vector<unsigned char> levels;
+        resolve_bidi_levels(types, levels);
+
+        // Neutral characters take the script of a neighbour at the same
+        // level - the one before, else the one after - or else of any
+        // neighbour
+        std::vector<bool> resolved(count);
+        for (size_t i = 0; i < count; i++) {
+            resolved[i] = !is_neutral_script(scripts[i]);
+        }
+        for (size_t i = 1; i < count; i++) {
+            if (!resolved[i] && resolved[i - 1] && levels[i] == levels[i - 1]) {
+                scripts[i] = scripts[i - 1];
+                resolved[i] = true;
+            }
+        }
+        for (size_t i = count - 1; i-- > 0;) {
+            if (!resolved[i] && resolved[i + 1] && levels[i] == levels[i + 1]) {
+                scripts[i] = scripts[i + 1];
+                resolved[i] = true;
+            }
+        }
+        for (size_t i = 1; i < count; i++) {
+            if (!resolved[i] && resolved[i - 1]) {
+                scripts[i] = scripts[i - 1];
+                resolved[i] = true;
+            }
+        }
+        for (size_t i = count - 1; i-- > 0;) {
+            if (!resolved[i] && resolved[i + 1]) {
+                scripts[i] = scripts[i + 1];
+                resolved[i] = true;
+            }
+        }
+
+        hb_language_t language = hb_language_get_default();
+        for (size_t i = 0; i < count; i++) {
+            if (i > 0 && scripts[i] == runs.back().script &&
+                    levels[i] == runs.back().level) {
+                continue;
+            }
+            if (!runs.empty()) {
+                runs.back().length = offsets[i] - runs.back().start;
+            }
+            struct rehb_run run = {
+                offsets[i], 0, scripts[i],
+                levels[i] % 2 ? HB_DIRECTION_RTL : HB_DIRECTION_LTR, language,
+                levels[i]
+            };
+            runs.push_back(run);
+        }
+        runs.back().length = start + len - runs.back().start;
+    }
+
+    // L2: the order runs are drawn in - from the highest level down to the
+    // lowest odd level, every sequence of runs at that level or higher is
+    // reversed
+    static void visual_order(const std::vector<struct rehb_run> &runs,
+                             std::vector<size_t> &order) {
+        order.resize(runs.size());
+        unsigned char highest = 0;
+        unsigned char lowestOdd = 255;
+        for (size_t i = 0; i < runs.size(); i++) {
+            order[i] = i;
+            highest = std::max(highest, runs[i].level);
+            if (runs[i].level % 2) {
+                lowestOdd = std::min(lowestOdd, runs[i].level);
+            }
+        }
+
+        for (int level = highest; level >= lowestOdd; level--) {
+            for (size_t i = 0; i < order.size();) {
+                if (runs[order[i]].level < level) {
+                    i++;
+                    continue;
+                }
+                size_t end = i;
+                while (end < order.size() && runs[order[end]].level >= level) {
+                    end++;
+                }
+                std::reverse(order.begin() + i, order.begin() + end);
+                i = end;
+            }
+        }
+    }
+
+    // Shape one run into [hb_buffer], with the surrounding text as context
+    static void shape_run(struct rehb_font *pFont, hb_buffer_t *hb_buffer,
+                          const char *str, const struct rehb_run *run,
+                          const struct rehb_features *features) {
+        hb_buffer_add_utf8(hb_buffer, str, -1, run->start, run->length);
+
+        hb_segment_properties_t props = HB_SEGMENT_PROPERTIES_DEFAULT;
+        props.direction = run->direction;
+        props.script = run->script;
+        props.language = run->language;
+        hb_buffer_set_segment_properties(hb_buffer, &props);
+
+        hb_shape_plan_t *plan =
+            get_shape_plan(pFont, &props, features->data, features->len);
+        if (!hb_shape_plan_execute(plan, pFont->font, hb_buffer, features->data,
+                                   features->len)) {
+            // Fall back to the default shaper list if the cached plan fails
+            hb_shape(pFont->font, hb_buffer, features->data, features->len);
+        }
+        hb_shape_plan_destroy(plan);
+    }
+
+    /* Simple text fast path: printable Latin-1 text in a face where none of
+       those characters take part in default GSUB/GPOS lookups shapes to its
+       nominal glyphs and advances, so it's served from a per-face table
+       instead of running the shaper. */
+    static bool is_simple_codepoint(hb_codepoint_t c) {
+        return (c >= 0x20 && c <= 0x7E) || (c >= 0xA0 && c <= 0xFF && c != 0xAD);
+    }
+
+    // Features HarfBuzz applies by default to horizontal text
+    static const hb_tag_t default_feature_tags[] = {
+        HB_TAG('a', 'b', 'v', 'm'), HB_TAG('b', 'l', 'w', 'm'),
+        HB_TAG('c', 'c', 'm', 'p'), HB_TAG('l', 'o', 'c', 'l'),
+        HB_TAG('m', 'a', 'r', 'k'), HB_TAG('m', 'k', 'm', 'k'),
+        HB_TAG('r', 'l', 'i', 'g'), HB_TAG('r', 'v', 'r', 'n'),
+        HB_TAG('c', 'a', 'l', 't'), HB_TAG('c', 'l', 'i', 'g'),
+        HB_TAG('c', 'u', 'r', 's'), HB_TAG('d', 'i', 's', 't'),
+        HB_TAG('k', 'e', 'r', 'n'), HB_TAG('l', 'i', 'g', 'a'),
+        HB_TAG('r', 'c', 'l', 't'), HB_TAG('l', 't', 'r', 'a'),
+        HB_TAG('l', 't', 'r', 'm'), HB_TAG('r', 'a', 'n', 'd'),
+        HB_TAG_NONE
+    };
+
+    static bool face_has_table(hb_face_t *face, hb_tag_t tag) {
+        hb_blob_t *blob = hb_face_reference_table(face, tag);
+        bool present = hb_blob_get_length(blob) > 0;
+        hb_blob_destroy(blob);
+        return present;
+    }
+
+    // Add every glyph that default lookups of [table] may read to [glyphs]
+    static void collect_layout_glyphs(hb_face_t *face, hb_tag_t table,
+                                      hb_set_t *glyphs) {
+        hb_set_t *lookups = hb_set_create();
+        hb_ot_layout_collect_lookups(face, table, nullptr, nullptr,
+                                     default_feature_tags, lookups);
+
+        hb_codepoint_t lookup = HB_SET_VALUE_INVALID;
+        while (hb_set_next(lookups, &lookup)) {
+            // Context glyphs count too - a lookup on a neighbour can still
+            // depend on them
+            hb_ot_layout_lookup_collect_glyphs(face, table, lookup, glyphs,
+                                               glyphs, glyphs, nullptr);
+        }
+        hb_set_destroy(lookups);
+    }
+
+    static struct rehb_simple_text *build_simple_text(hb_font_t *font) {
+        hb_face_t *face = hb_font_get_face(font);
+
+        // Legacy and AAT layout tables aren't covered by the lookup check
+        if (face_has_table(face, HB_TAG('k', 'e', 'r', 'n')) ||
+                face_has_table(face, HB_TAG('k', 'e', 'r', 'x')) ||
+                face_has_table(face, HB_TAG('m', 'o', 'r', 'x')) ||
+                face_has_table(face, HB_TAG('m', 'o', 'r', 't')) ||
+                face_has_table(face, HB_TAG('t', 'r', 'a', 'k'))) {
+            return nullptr;
+        }
+
+        struct rehb_simple_text *simpleText = new rehb_simple_text();
+
+        hb_codepoint_t codepoints[REHB_SIMPLE_TEXT_SIZE];
+        for (hb_codepoint_t c = 0; c < REHB_SIMPLE_TEXT_SIZE; c++) {
+            codepoints[c] = c;
+            simpleText->glyphs[c] = 0;
+        }
+        hb_font_get_nominal_glyphs(font, REHB_SIMPLE_TEXT_SIZE, codepoints,
+                                   sizeof(hb_codepoint_t), simpleText->glyphs,
+                                   sizeof(hb_codepoint_t));
+        hb_font_get_glyph_h_advances(font, REHB_SIMPLE_TEXT_SIZE,
+                                     simpleText->glyphs, sizeof(hb_codepoint_t),
+                                     simpleText->advances,
+                                     sizeof(hb_position_t));
+
+        hb_set_t *layoutGlyphs = hb_set_create();
+        collect_layout_glyphs(face, HB_OT_TAG_GSUB, layoutGlyphs);
+        collect_layout_glyphs(face, HB_OT_TAG_GPOS, layoutGlyphs);
+
+        for (hb_codepoint_t c = 0; c < REHB_SIMPLE_TEXT_SIZE; c++) {
+            hb_codepoint_t glyph = simpleText->glyphs[c];
+            simpleText->simple[c] = is_simple_codepoint(c) && glyph != 0 &&
+                                    !hb_set_has(layoutGlyphs, glyph);
+        }
+        hb_set_destroy(layoutGlyphs);
+
+        return simpleText;
+    }
+
+    static struct rehb_simple_text *simple_text_of_font(struct rehb_font *pFont) {
+        std::call_once(pFont->simpleTextOnce, [pFont]() {
+            pFont->simpleText = build_simple_text(pFont->font);
+        });
+        return pFont->simpleText;
+    }
+
+    // Fill [hb_buffer] with the glyphs of [len] bytes of [str] from [start]
+    // if every character is simple; otherwise leaves it untouched and
+    // returns false.
+    static bool shape_simple_text(struct rehb_font *pFont, hb_buffer_t *hb_buffer,
+                                  const char *str, int start, int len) {
+        struct rehb_simple_text *simpleText = simple_text_of_font(pFont);
+        if (!simpleText) {
+            return false;
+        }
+
+        if (len < 0) {
+            len = (int)strlen(str + start);
+        }
+
+        const unsigned char *text = (const unsigned char *)str;
+        const unsigned char *end = text + start + len;
+
+        // Check the whole range before writing anything
+        int pos = start;
+        while (pos < start + len) {
+            int size;
+            hb_codepoint_t c = decode_utf8(text + pos, end, &size);
+            if (c >= REHB_SIMPLE_TEXT_SIZE || !simpleText->simple[c]) {
+                return false;
+            }
+            pos += size;
+        }
+
+        hb_buffer_set_content_type(hb_buffer, HB_BUFFER_CONTENT_TYPE_GLYPHS);
+        for (pos = start; pos < start + len;) {
+            int size;
+            hb_codepoint_t c = decode_utf8(text + pos, end, &size);
+            hb_buffer_add(hb_buffer, simpleText->glyphs[c], pos);
+            pos += size;
+        }
+
+        // Positions are zero-initialized on first access
+        unsigned int glyph_count;
+        hb_glyph_position_t *positions =
+            hb_buffer_get_glyph_positions(hb_buffer, &glyph_count);
+        unsigned int i = 0;
+        for (pos = start; pos < start + len; i++) {
+            int size;
+            hb_codepoint_t c = decode_utf8(text + pos, end, &size);
+            positions[i].x_advance = simpleText->advances[c];
+            pos += size;
+        }
+        return true;
+    }
+
+    // Shape [len] bytes of [str] from [start] - the returned buffer
+    // must be handed back with [release_buffer]. Runs are shaped
+    // separately and their glyphs concatenated in visual order.
+    static hb_buffer_t *shape_utf8(struct rehb_font *pFont, const char *str,
+                                   int start, int len,
+                                   const struct rehb_features *features) {
+        hb_buffer_t *hb_buffer = acquire_buffer();
+
+        if (features->len == 0 &&
+                shape_simple_text(pFont, hb_buffer, str, start, len)) {
+            return hb_buffer;
+        }
+
+        std::vector<struct rehb_run> runs;
+        itemize_utf8(str, start, len, runs);
+        if (runs.empty()) {
+            struct rehb_run empty = {start, 0, HB_SCRIPT_COMMON, HB_DIRECTION_LTR,
+                                     hb_language_get_default(), 0
+                                    };
+            runs.push_back(empty);
+        }
+
+        if (runs.size() == 1) {
+            shape_run(pFont, hb_buffer, str, &runs[0], features);
+            return hb_buffer;
+        }
+
+        std::vector<size_t> order;
+        visual_order(runs, order);
+
+        hb_buffer_t *run_buffer = acquire_buffer();
+        for (size_t idx : order) {
+            shape_run(pFont, run_buffer, str, &runs[idx], features);
+            hb_buffer_append(hb_buffer, run_buffer, 0, (unsigned int)-1);
+            hb_buffer_clear_contents(run_buffer);
+        }
+        release_buffer(run_buffer);
+
+        return hb_buffer;
+    }
+
+    // Returns the runs of [len] bytes of [vString] from [vStart] as an array
+    // of Harfbuzz.run records (start, length, script tag, direction,
+    // language, level).
+    CAMLprim value rehb_itemize(value vString, value vStart, value vLen) {
+        CAMLparam3(vString, vStart, vLen);
+        CAMLlocal4(ret, vRun, vScript, vLanguage);
+
+        std::vector<struct rehb_run> runs;
+        itemize_utf8(String_val(vString), Int_val(vStart), Int_val(vLen), runs);
+
+        ret = caml_alloc(runs.size(), 0);
+        for (size_t i = 0; i < runs.size(); i++) {
+            char tag[4];
+            hb_tag_to_string(hb_script_to_iso15924_tag(runs[i].script), tag);
+            vScript = caml_alloc_initialized_string(4, tag);
+            const char *language = hb_language_to_string(runs[i].language);
+            vLanguage = caml_copy_string(language ? language : "");
+
+            vRun = caml_alloc(6, 0);
+            Store_field(vRun, 0, Val_int(runs[i].start));
+            Store_field(vRun, 1, Val_int(runs[i].length));
+            Store_field(vRun, 2, vScript);
+            // Harfbuzz.direction: LeftToRight | RightToLeft
+            Store_field(vRun, 3,
+                        Val_int(HB_DIRECTION_IS_BACKWARD(runs[i].direction) ? 1 : 0));
+            Store_field(vRun, 4, vLanguage);
+            Store_field(vRun, 5, Val_int(runs[i].level));
+            Store_field(ret, i, vRun);
+        }
+        CAMLreturn(ret);
+    }
+
+    static bool should_release_runtime(struct rehb_font *pFont, value vString) {
+        return !pFont->needsRuntime &&
+               caml_string_length(vString) >= REHB_RELEASE_RUNTIME_MIN_BYTES;
+    }
+
+    // NUL-terminated C copy of an OCaml string, safe to read while the
+    // runtime is released (caller frees)
+    static char *copy_string(value vString) {
+        mlsize_t length = caml_string_length(vString);
+        char *copy = (char *)malloc(length + 1);
+        std::memcpy(copy, String_val(vString), length + 1);
+        return copy;
+    }
+
+    /* Like [shape_utf8], but for long inputs the string is copied and the
+       OCaml runtime released while HarfBuzz runs, so other threads (and
+       other domains' stop-the-world sections) aren't blocked. [vFace] and
+       [vString] must be registered roots of the caller. */
+    static hb_buffer_t *shape_value(struct rehb_font *pFont, value vString,
+                                    int start, int len,
+                                    const struct rehb_features *features) {
+        if (!should_release_runtime(pFont, vString)) {
+            return shape_utf8(pFont, String_val(vString), start, len, features);
+        }
+
+        char *str = copy_string(vString);
+        caml_release_runtime_system();
+        hb_buffer_t *hb_buffer = shape_utf8(pFont, str, start, len, features);
+        caml_acquire_runtime_system();
+        free(str);
+        return hb_buffer;
+    }
+
     /* Use native open type implementation to load font
       https://github.com/harfbuzz/harfbuzz/issues/255 */
     hb_font_t *get_font_ot(char *data, int length, int size) {
@@ -72,41 +1044,194 @@ extern "C" {
         return font;
     }
 
-    CAMLprim value rehb_face_from_path(value vString) {
-        CAMLparam1(vString);
-        CAMLlocal1(ret);
+    /* Read-only file mappings, shared by every face opened from the same
+       file (including the faces of a collection). Entries are keyed by the
+       file identity and modification time, so a font file replaced on disk
+       gets a fresh mapping. */
+    struct rehb_mapping_key {
+        uint64_t device;
+        uint64_t inode;
+        int64_t mtime;
+        uint64_t size;
+
+        bool operator<(const rehb_mapping_key &other) const {
+            if (device != other.device) {
+                return device < other.device;
+            }
+            if (inode != other.inode) {
+                return inode < other.inode;
+            }
+            if (mtime != other.mtime) {
+                return mtime < other.mtime;
+            }
+            return size < other.size;
+        }
+    };
+
+    struct rehb_mapping {
+        rehb_mapping_key key;
+        const char *data;
+        size_t size;
+        unsigned int refs;
+#ifdef _WIN32
+        HANDLE handle;
+#endif
+    };
+
+    static std::map<rehb_mapping_key, rehb_mapping *> mapping_registry;
+    static std::mutex mapping_registry_lock;
+
+    // Map [path], or reuse an existing mapping of the same file.
+    // Returns nullptr and sets [error] on failure.
+    static rehb_mapping *acquire_mapping(const char *path, const char **error) {
+        rehb_mapping_key key;
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            *error = "File does not exist";
+            return nullptr;
+        }
+        BY_HANDLE_FILE_INFORMATION info;
+        if (!GetFileInformationByHandle(file, &info)) {
+            CloseHandle(file);
+            *error = "Unable to load font";
+            return nullptr;
+        }
+        key.device = info.dwVolumeSerialNumber;
+        key.inode = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+        key.mtime = ((int64_t)info.ftLastWriteTime.dwHighDateTime << 32) |
+                    info.ftLastWriteTime.dwLowDateTime;
+        key.size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+#else
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            *error = "File does not exist";
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            *error = "Unable to load font";
+            return nullptr;
+        }
+        key.device = (uint64_t)st.st_dev;
+        key.inode = (uint64_t)st.st_ino;
+        key.mtime = (int64_t)st.st_mtime;
+        key.size = (uint64_t)st.st_size;
+#endif
+
+        std::lock_guard<std::mutex> guard(mapping_registry_lock);
+
+        auto existing = mapping_registry.find(key);
+        if (existing != mapping_registry.end()) {
+#ifdef _WIN32
+            CloseHandle(file);
+#else
+            close(fd);
+#endif
+            existing->second->refs++;
+            return existing->second;
+        }
 
-        const char *szFont = String_val(vString);
+        const char *data = nullptr;
+#ifdef _WIN32
+        HANDLE handle = NULL;
+#endif
+        if (key.size > 0) {
+#ifdef _WIN32
+            handle =
+                CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (handle) {
+                data = (const char *)MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0);
+                if (!data) {
+                    CloseHandle(handle);
+                }
+            }
+#else
+            void *addr = mmap(NULL, (size_t)key.size, PROT_READ, MAP_PRIVATE, fd, 0);
+            data = addr == MAP_FAILED ? nullptr : (const char *)addr;
+#endif
+        }
+        // The mapping stays valid once the file is closed
+#ifdef _WIN32
+        CloseHandle(file);
+#else
+        close(fd);
+#endif
+
+        if (!data) {
+            *error = "Unable to load font";
+            return nullptr;
+        }
 
-        FILE *file = fopen(szFont, "rb");
+        rehb_mapping *mapping = new rehb_mapping();
+        mapping->key = key;
+        mapping->data = data;
+        mapping->size = (size_t)key.size;
+        mapping->refs = 1;
+#ifdef _WIN32
+        mapping->handle = handle;
+#endif
+        mapping_registry[key] = mapping;
+        return mapping;
+    }
 
-        if (!file) {
-            CAMLreturn(Val_error("File does not exist"));
+    // hb_blob_t destroy callback - unmaps once the last blob is gone
+    static void release_mapping(void *user_data) {
+        rehb_mapping *mapping = (rehb_mapping *)user_data;
+
+        std::lock_guard<std::mutex> guard(mapping_registry_lock);
+        if (--mapping->refs > 0) {
+            return;
         }
 
-        fseek(file, 0, SEEK_END);
-        unsigned int length = ftell(file);
-        fseek(file, 0, SEEK_SET);
+        mapping_registry.erase(mapping->key);
+#ifdef _WIN32
+        UnmapViewOfFile(mapping->data);
+        CloseHandle(mapping->handle);
+#else
+        munmap((void *)mapping->data, mapping->size);
+#endif
+        delete mapping;
+    }
 
-        char *data = (char *)malloc(length);
-        fread(data, length, 1, file);
-        fclose(file);
+    CAMLprim value rehb_face_from_path(value vString, value vIndex) {
+        CAMLparam2(vString, vIndex);
+        CAMLlocal1(ret);
 
-        hb_font_t *hb_font;
-        hb_font = get_font_ot(data, length, 12 /*iSize*/ * 64);
+        const char *error = nullptr;
+        rehb_mapping *mapping = acquire_mapping(String_val(vString), &error);
+
+        if (!mapping) {
+            CAMLreturn(Val_error(error));
+        }
+
+        // Each face gets its own lightweight blob over the shared mapping
+        hb_blob_t *blob =
+            hb_blob_create(mapping->data, (unsigned int)mapping->size,
+                           HB_MEMORY_MODE_READONLY, mapping, release_mapping);
+        hb_face_t *face = hb_face_create(blob, (unsigned int)Int_val(vIndex));
+        hb_blob_destroy(blob); // face will keep a reference to blob
+
+        hb_font_t *hb_font = hb_font_create(face);
+        hb_face_destroy(face); // font will keep a reference to face
+
+        hb_ot_font_set_funcs(hb_font);
 
         if (!hb_font) {
             ret = Val_error("Unable to load font");
         } else {
-            CAMLlocal1(custom_font_block);
-            custom_font_block =
-                caml_alloc_custom(&hb_font_custom_ops, sizeof(hb_font_t *), 0, 1);
-            *((hb_font_t **)Data_custom_val(custom_font_block)) = hb_font;
-            ret = Val_success(custom_font_block);
+            ret = Val_success(alloc_font_block(hb_font, false));
         }
         CAMLreturn(ret);
     }
 
+    CAMLprim value rehb_mapped_file_count(value vUnit) {
+        std::lock_guard<std::mutex> guard(mapping_registry_lock);
+        return Val_int(mapping_registry.size());
+    }
+
     CAMLprim value rehb_face_from_bytes(value vPtr, value vLength) {
         CAMLparam2(vPtr, vLength);
         CAMLlocal1(ret);
@@ -123,11 +1248,7 @@ extern "C" {
         if (!hb_font) {
             ret = Val_error("Unable to load font");
         } else {
-            CAMLlocal1(custom_font_block);
-            custom_font_block =
-                caml_alloc_custom(&hb_font_custom_ops, sizeof(hb_font_t *), 0, 1);
-            *((hb_font_t **)Data_custom_val(custom_font_block)) = hb_font;
-            ret = Val_success(custom_font_block);
+            ret = Val_success(alloc_font_block(hb_font, false));
         }
         CAMLreturn(ret);
     }
@@ -155,11 +1276,7 @@ extern "C" {
         if (!font) {
             ret = Val_error("Unable to load font from memory");
         } else {
-            CAMLlocal1(custom_font_block);
-            custom_font_block =
-                caml_alloc_custom(&hb_font_custom_ops, sizeof(hb_font_t *), 0, 1);
-            *((hb_font_t **)Data_custom_val(custom_font_block)) = font;
-            ret = Val_success(custom_font_block);
+            ret = Val_success(alloc_font_block(font, false));
         }
         CAMLreturn(ret);
     }
@@ -194,28 +1311,7 @@ extern "C" {
         CAMLreturn(recordBlock);
     }
 
-    CAMLprim value rehb_shape(value vFace, value vString, value vFeatures,
-                              value vStart, value vLen, value vFontSize) {
-        CAMLparam5(vFace, vString, vFeatures, vStart, vLen);
-        CAMLxparam1(vFontSize);
-        CAMLlocal3(ret, feat, shapedGlyphRecord);
-
-        int start = Int_val(vStart);
-        int len = Int_val(vLen);
-
-        int featuresLen = Wosize_val(vFeatures);
-        hb_feature_t *features =
-            (hb_feature_t *)malloc(featuresLen * sizeof(hb_feature_t));
-        for (int i = 0; i < featuresLen; i++) {
-            feat = Field(vFeatures, i);
-            const char *tag = String_val(Field(feat, 0));
-            features[i].tag = HB_TAG(tag[0], tag[1], tag[2], tag[3]);
-            features[i].value = Int_val(Field(feat, 1));
-            features[i].start = Int_val(Field(feat, 2));
-            features[i].end = Int_val(Field(feat, 3));
-        }
-
-        hb_font_t *hb_font = *((hb_font_t **)Data_custom_val(vFace));
+    static double units_per_em_of_font(hb_font_t *hb_font) {
         hb_face_t *hb_face = hb_font_get_face(hb_font);
         double units_per_em = (double)hb_face_get_upem(hb_face);
 
@@ -223,14 +1319,23 @@ extern "C" {
         if (units_per_em <= 0.0) {
             units_per_em = 1000.0; // Use standard default value
         }
+        return units_per_em;
+    }
 
-        // Create new buffer for each call to avoid reuse issues
-        hb_buffer_t *hb_buffer = hb_buffer_create();
+    double rehb_face_get_upem(value vFace) {
+        return units_per_em_of_font(Rehb_font_val(vFace)->font);
+    }
 
-        hb_buffer_add_utf8(hb_buffer, String_val(vString), -1, start, len);
-        hb_buffer_guess_segment_properties(hb_buffer);
+    CAMLprim value rehb_face_get_upem_byte(value vFace) {
+        return caml_copy_double(rehb_face_get_upem(vFace));
+    }
 
-        hb_shape(hb_font, hb_buffer, features, featuresLen);
+    /* Allocates an array of Harfbuzz.hb_shape records for the glyphs of a
+       shaped buffer */
+    static value shaped_glyph_records(hb_buffer_t *hb_buffer,
+                                      double units_per_em) {
+        CAMLparam0();
+        CAMLlocal2(ret, shapedGlyphRecord);
 
         unsigned int glyph_count;
         hb_glyph_info_t *info = hb_buffer_get_glyph_infos(hb_buffer, &glyph_count);
@@ -246,8 +1351,266 @@ extern "C" {
                                     units_per_em);
             Store_field(ret, i, shapedGlyphRecord);
         }
-        free(features);
-        hb_buffer_destroy(hb_buffer);
+        CAMLreturn(ret);
+    }
+
+    CAMLprim value rehb_shape(value vFace, value vString, value vFeatures,
+                              value vStart, value vLen) {
+        CAMLparam5(vFace, vString, vFeatures, vStart, vLen);
+        CAMLlocal1(ret);
+
+        int start = Int_val(vStart);
+        int len = Int_val(vLen);
+
+        struct rehb_features features;
+        features_of_value(vFeatures, &features);
+
+        struct rehb_font *pFont = Rehb_font_val(vFace);
+        double units_per_em = units_per_em_of_font(pFont->font);
+
+        hb_buffer_t *hb_buffer =
+            shape_value(pFont, vString, start, len, &features);
+        features_free(&features);
+
+        ret = shaped_glyph_records(hb_buffer, units_per_em);
+        release_buffer(hb_buffer);
+        CAMLreturn(ret);
+    }
+
+    /* Like [rehb_shape], but returns a pair of the glyph records and an int
+       array of the hb_glyph_flags_t of each glyph */
+    CAMLprim value rehb_shape_with_flags(value vFace, value vString,
+                                         value vFeatures, value vStart,
+                                         value vLen) {
+        CAMLparam5(vFace, vString, vFeatures, vStart, vLen);
+        CAMLlocal3(ret, vGlyphs, vFlags);
+
+        int start = Int_val(vStart);
+        int len = Int_val(vLen);
+
+        struct rehb_features features;
+        features_of_value(vFeatures, &features);
+
+        struct rehb_font *pFont = Rehb_font_val(vFace);
+        double units_per_em = units_per_em_of_font(pFont->font);
+
+        hb_buffer_t *hb_buffer =
+            shape_value(pFont, vString, start, len, &features);
+        features_free(&features);
+
+        vGlyphs = shaped_glyph_records(hb_buffer, units_per_em);
+
+        unsigned int glyph_count;
+        hb_glyph_info_t *info = hb_buffer_get_glyph_infos(hb_buffer, &glyph_count);
+        vFlags = caml_alloc(glyph_count, 0);
+        for (unsigned int i = 0; i < glyph_count; i++) {
+            Store_field(vFlags, i, Val_int(hb_glyph_info_get_glyph_flags(&info[i])));
+        }
+        release_buffer(hb_buffer);
+
+        ret = caml_alloc_tuple(2);
+        Store_field(ret, 0, vGlyphs);
+        Store_field(ret, 1, vFlags);
+        CAMLreturn(ret);
+    }
+
+    /* Struct-of-arrays output: [vGlyphs] is a Harfbuzz.GlyphBuffer.t record
+       whose fields are, in order, the int32 glyph id and cluster arrays and
+       the float32 x/y advance and x/y offset arrays. */
+    enum {
+        GLYPH_BUFFER_GLYPH_IDS = 0,
+        GLYPH_BUFFER_CLUSTERS,
+        GLYPH_BUFFER_X_ADVANCES,
+        GLYPH_BUFFER_Y_ADVANCES,
+        GLYPH_BUFFER_X_OFFSETS,
+        GLYPH_BUFFER_Y_OFFSETS,
+        GLYPH_BUFFER_FIELD_COUNT
+    };
+
+    static unsigned int glyph_buffer_capacity(value vGlyphs) {
+        unsigned int capacity = (unsigned int)-1;
+        for (int i = 0; i < GLYPH_BUFFER_FIELD_COUNT; i++) {
+            unsigned int dim =
+                (unsigned int)Caml_ba_array_val(Field(vGlyphs, i))->dim[0];
+            if (dim < capacity) {
+                capacity = dim;
+            }
+        }
+        return capacity;
+    }
+
+    // Shapes [vString] and writes as many glyphs as fit into [vGlyphs].
+    // Returns the total glyph count, which can exceed the buffer capacity -
+    // in that case the caller is expected to grow the buffer and retry.
+    // Nothing is allocated on the OCaml heap.
+    CAMLprim value rehb_shape_into(value vFace, value vString, value vFeatures,
+                                   value vStart, value vLen, value vGlyphs) {
+        CAMLparam5(vFace, vString, vFeatures, vStart, vLen);
+        CAMLxparam1(vGlyphs);
+
+        int start = Int_val(vStart);
+        int len = Int_val(vLen);
+
+        struct rehb_features features;
+        features_of_value(vFeatures, &features);
+
+        hb_buffer_t *hb_buffer = shape_value(Rehb_font_val(vFace), vString, start,
+                                             len, &features);
+        features_free(&features);
+
+        unsigned int glyph_count;
+        hb_glyph_info_t *info = hb_buffer_get_glyph_infos(hb_buffer, &glyph_count);
+        hb_glyph_position_t *positions =
+            hb_buffer_get_glyph_positions(hb_buffer, &glyph_count);
+
+        unsigned int capacity = glyph_buffer_capacity(vGlyphs);
+        unsigned int count = glyph_count < capacity ? glyph_count : capacity;
+
+        int32_t *glyphIds =
+            (int32_t *)Caml_ba_data_val(Field(vGlyphs, GLYPH_BUFFER_GLYPH_IDS));
+        int32_t *clusters =
+            (int32_t *)Caml_ba_data_val(Field(vGlyphs, GLYPH_BUFFER_CLUSTERS));
+        float *xAdvances =
+            (float *)Caml_ba_data_val(Field(vGlyphs, GLYPH_BUFFER_X_ADVANCES));
+        float *yAdvances =
+            (float *)Caml_ba_data_val(Field(vGlyphs, GLYPH_BUFFER_Y_ADVANCES));
+        float *xOffsets =
+            (float *)Caml_ba_data_val(Field(vGlyphs, GLYPH_BUFFER_X_OFFSETS));
+        float *yOffsets =
+            (float *)Caml_ba_data_val(Field(vGlyphs, GLYPH_BUFFER_Y_OFFSETS));
+
+        for (unsigned int i = 0; i < count; i++) {
+            glyphIds[i] = (int32_t)info[i].codepoint;
+            clusters[i] = (int32_t)info[i].cluster;
+            xAdvances[i] = (float)positions[i].x_advance;
+            yAdvances[i] = (float)positions[i].y_advance;
+            xOffsets[i] = (float)positions[i].x_offset;
+            yOffsets[i] = (float)positions[i].y_offset;
+        }
+
+        release_buffer(hb_buffer);
+        CAMLreturn(Val_int(glyph_count));
+    }
+
+    CAMLprim value rehb_shape_into_byte(value *argv, int argn) {
+        return rehb_shape_into(argv[0], argv[1], argv[2], argv[3], argv[4],
+                               argv[5]);
+    }
+
+    static value alloc_float32_array(const std::vector<float> &data) {
+        value ret = caml_ba_alloc_dims(CAML_BA_FLOAT32 | CAML_BA_C_LAYOUT, 1,
+                                       NULL, (intnat)data.size());
+        if (!data.empty()) {
+            std::memcpy(Caml_ba_data_val(ret), data.data(),
+                        data.size() * sizeof(float));
+        }
+        return ret;
+    }
+
+    static value alloc_int32_array(const std::vector<int32_t> &data) {
+        value ret = caml_ba_alloc_dims(CAML_BA_INT32 | CAML_BA_C_LAYOUT, 1, NULL,
+                                       (intnat)data.size());
+        if (!data.empty()) {
+            std::memcpy(Caml_ba_data_val(ret), data.data(),
+                        data.size() * sizeof(int32_t));
+        }
+        return ret;
+    }
+
+    /* Shape every span of [vString] in one call. [vSpans] is an array of
+       Harfbuzz.Internal.span records (start, length, features). The result
+       is a Harfbuzz.batch record: a packed GlyphBuffer.t holding the glyphs
+       of all spans, and the glyph offset of each span (plus the total). */
+    CAMLprim value rehb_shape_batch(value vFace, value vString, value vSpans) {
+        CAMLparam3(vFace, vString, vSpans);
+        CAMLlocal3(ret, vGlyphs, vOffsets);
+        CAMLlocal5(vIds, vClusters, vXAdvances, vYAdvances, vXOffsets);
+        CAMLlocal1(vYOffsets);
+
+        struct rehb_font *pFont = Rehb_font_val(vFace);
+        unsigned int spanCount = Wosize_val(vSpans);
+
+        // Read every span up front, so the whole batch can be shaped
+        // without touching the OCaml heap
+        std::vector<int> starts(spanCount), lengths(spanCount);
+        std::vector<struct rehb_features> spanFeatures(spanCount);
+        size_t totalBytes = 0;
+        for (unsigned int spanIdx = 0; spanIdx < spanCount; spanIdx++) {
+            value vSpan = Field(vSpans, spanIdx);
+            starts[spanIdx] = Int_val(Field(vSpan, 0));
+            lengths[spanIdx] = Int_val(Field(vSpan, 1));
+            features_of_value(Field(vSpan, 2), &spanFeatures[spanIdx]);
+            totalBytes += lengths[spanIdx] > 0 ? lengths[spanIdx] : 0;
+        }
+
+        bool releaseRuntime = !pFont->needsRuntime &&
+                              totalBytes >= REHB_RELEASE_RUNTIME_MIN_BYTES;
+        char *strCopy = releaseRuntime ? copy_string(vString) : nullptr;
+        const char *str = releaseRuntime ? strCopy : String_val(vString);
+
+        std::vector<int32_t> glyphIds, clusters;
+        std::vector<float> xAdvances, yAdvances, xOffsets, yOffsets;
+        std::vector<intnat> offsets(spanCount + 1, 0);
+
+        if (releaseRuntime) {
+            caml_release_runtime_system();
+        }
+
+        for (unsigned int spanIdx = 0; spanIdx < spanCount; spanIdx++) {
+            struct rehb_features *features = &spanFeatures[spanIdx];
+
+            hb_buffer_t *hb_buffer = shape_utf8(pFont, str, starts[spanIdx],
+                                                lengths[spanIdx], features);
+            features_free(features);
+
+            unsigned int glyph_count;
+            hb_glyph_info_t *info = hb_buffer_get_glyph_infos(hb_buffer, &glyph_count);
+            hb_glyph_position_t *positions =
+                hb_buffer_get_glyph_positions(hb_buffer, &glyph_count);
+
+            for (unsigned int i = 0; i < glyph_count; i++) {
+                glyphIds.push_back((int32_t)info[i].codepoint);
+                clusters.push_back((int32_t)info[i].cluster);
+                xAdvances.push_back((float)positions[i].x_advance);
+                yAdvances.push_back((float)positions[i].y_advance);
+                xOffsets.push_back((float)positions[i].x_offset);
+                yOffsets.push_back((float)positions[i].y_offset);
+            }
+            release_buffer(hb_buffer);
+
+            offsets[spanIdx + 1] = offsets[spanIdx] + glyph_count;
+        }
+
+        if (releaseRuntime) {
+            caml_acquire_runtime_system();
+            free(strCopy);
+        }
+
+        // Allocate every array before the record, so no field address is
+        // computed across an allocation
+        vIds = alloc_int32_array(glyphIds);
+        vClusters = alloc_int32_array(clusters);
+        vXAdvances = alloc_float32_array(xAdvances);
+        vYAdvances = alloc_float32_array(yAdvances);
+        vXOffsets = alloc_float32_array(xOffsets);
+        vYOffsets = alloc_float32_array(yOffsets);
+
+        vGlyphs = caml_alloc(GLYPH_BUFFER_FIELD_COUNT, 0);
+        Store_field(vGlyphs, GLYPH_BUFFER_GLYPH_IDS, vIds);
+        Store_field(vGlyphs, GLYPH_BUFFER_CLUSTERS, vClusters);
+        Store_field(vGlyphs, GLYPH_BUFFER_X_ADVANCES, vXAdvances);
+        Store_field(vGlyphs, GLYPH_BUFFER_Y_ADVANCES, vYAdvances);
+        Store_field(vGlyphs, GLYPH_BUFFER_X_OFFSETS, vXOffsets);
+        Store_field(vGlyphs, GLYPH_BUFFER_Y_OFFSETS, vYOffsets);
+
+        vOffsets = caml_alloc(spanCount + 1, 0);
+        for (unsigned int i = 0; i <= spanCount; i++) {
+            Store_field(vOffsets, i, Val_long(offsets[i]));
+        }
+
+        ret = caml_alloc(2, 0);
+        Store_field(ret, 0, vGlyphs);
+        Store_field(ret, 1, vOffsets);
         CAMLreturn(ret);
     }
 
@@ -342,11 +1705,201 @@ extern "C" {
         if (!font) {
             ret = Val_error("Unable to create font from tables");
         } else {
-            CAMLlocal1(custom_font_block);
-            custom_font_block =
-                caml_alloc_custom(&hb_font_custom_ops, sizeof(hb_font_t *), 0, 1);
-            *((hb_font_t **)Data_custom_val(custom_font_block)) = font;
-            ret = Val_success(custom_font_block);
+            ret = Val_success(alloc_font_block(font, true));
+        }
+
+        CAMLreturn(ret);
+    }
+
+    /* Variable fonts: an instance is a font of its own over the face of the
+       parent, with its own variation coordinates, so every instance shares
+       the face (and its blob) and only differs in the coordinates used for
+       shaping. A sub font would take its advances from the parent's font
+       functions, which ignore the coordinates of the sub font. */
+    CAMLprim value rehb_face_create_variation(value vFace, value vVariations) {
+        CAMLparam2(vFace, vVariations);
+
+        struct rehb_font *pParent = Rehb_font_val(vFace);
+        unsigned int len = Wosize_val(vVariations);
+
+        std::vector<hb_variation_t> variations(len);
+        for (unsigned int i = 0; i < len; i++) {
+            value vVariation = Field(vVariations, i);
+            const char *tag = String_val(Field(vVariation, 0));
+            variations[i].tag = HB_TAG(tag[0], tag[1], tag[2], tag[3]);
+            variations[i].value = (float)Double_val(Field(vVariation, 1));
+        }
+
+        hb_font_t *font = hb_font_create(hb_font_get_face(pParent->font));
+        hb_ot_font_set_funcs(font);
+        hb_font_set_variations(font, variations.data(), len);
+
+        CAMLreturn(alloc_font_block(font, pParent->needsRuntime));
+    }
+
+    // Returns the variation axes of the face as an array of
+    // Harfbuzz.variationAxis records (tag, min, default, max)
+    CAMLprim value rehb_face_get_variation_axes(value vFace) {
+        CAMLparam1(vFace);
+        CAMLlocal3(ret, vAxis, vTag);
+        CAMLlocal3(vMin, vDefault, vMax);
+
+        hb_face_t *face = hb_font_get_face(Rehb_font_val(vFace)->font);
+        unsigned int count = hb_ot_var_get_axis_infos(face, 0, nullptr, nullptr);
+        std::vector<hb_ot_var_axis_info_t> axes(count);
+        if (count > 0) {
+            hb_ot_var_get_axis_infos(face, 0, &count, axes.data());
+        }
+
+        ret = caml_alloc(count, 0);
+        for (unsigned int i = 0; i < count; i++) {
+            char tag[4];
+            hb_tag_to_string(axes[i].tag, tag);
+            vTag = caml_alloc_initialized_string(4, tag);
+            vMin = caml_copy_double(axes[i].min_value);
+            vDefault = caml_copy_double(axes[i].default_value);
+            vMax = caml_copy_double(axes[i].max_value);
+
+            vAxis = caml_alloc(4, 0);
+            Store_field(vAxis, 0, vTag);
+            Store_field(vAxis, 1, vMin);
+            Store_field(vAxis, 2, vDefault);
+            Store_field(vAxis, 3, vMax);
+            Store_field(ret, i, vAxis);
+        }
+        CAMLreturn(ret);
+    }
+
+    // Returns the codepoints mapped by the face's cmap as a flat int array
+    // of inclusive ranges: [first0, last0, first1, last1, ...]
+    CAMLprim value rehb_face_collect_unicode_ranges(value vFace) {
+        CAMLparam1(vFace);
+        CAMLlocal1(ret);
+
+        hb_face_t *face = hb_font_get_face(Rehb_font_val(vFace)->font);
+        hb_set_t *unicodes = hb_set_create();
+        hb_face_collect_unicodes(face, unicodes);
+
+        std::vector<hb_codepoint_t> ranges;
+        hb_codepoint_t first = HB_SET_VALUE_INVALID;
+        hb_codepoint_t last = HB_SET_VALUE_INVALID;
+        while (hb_set_next_range(unicodes, &first, &last)) {
+            ranges.push_back(first);
+            ranges.push_back(last);
+        }
+        hb_set_destroy(unicodes);
+
+        ret = caml_alloc(ranges.size(), 0);
+        for (size_t i = 0; i < ranges.size(); i++) {
+            Store_field(ret, i, Val_int(ranges[i]));
+        }
+        CAMLreturn(ret);
+    }
+
+    /* Native table loading: tables are fetched through C function pointers
+       supplied by the caller (ie, Skia's typeface table access), so shaping
+       never re-enters the OCaml runtime. Each table is loaded once, wrapped
+       in an immutable blob that references the loader's buffer directly,
+       and kept for the lifetime of the face. */
+    typedef const void *(*rehb_copy_table_func)(void *source, uint32_t tag,
+            size_t *length, void **handle);
+    typedef void (*rehb_release_table_func)(void *handle);
+    typedef void (*rehb_source_ref_func)(void *source);
+
+    struct rehb_native_tables {
+        // Referenced for the lifetime of the face, as HarfBuzz loads tables
+        // lazily - possibly after the caller has dropped the source
+        void *source;
+        rehb_source_ref_func releaseSource;
+        rehb_copy_table_func copyTable;
+        rehb_release_table_func releaseTable;
+        std::mutex lock;
+        std::map<hb_tag_t, hb_blob_t *> tables;
+    };
+
+    struct rehb_native_table_handle {
+        rehb_release_table_func releaseTable;
+        void *handle;
+    };
+
+    static void release_native_table(void *user_data) {
+        rehb_native_table_handle *table = (rehb_native_table_handle *)user_data;
+        table->releaseTable(table->handle);
+        delete table;
+    }
+
+    static hb_blob_t *get_native_table(hb_face_t *face, hb_tag_t tag,
+                                       void *user_data) {
+        rehb_native_tables *tables = (rehb_native_tables *)user_data;
+        std::lock_guard<std::mutex> guard(tables->lock);
+
+        auto cached = tables->tables.find(tag);
+        if (cached != tables->tables.end()) {
+            return hb_blob_reference(cached->second);
+        }
+
+        size_t length = 0;
+        void *handle = nullptr;
+        const void *data =
+            tables->copyTable(tables->source, tag, &length, &handle);
+
+        // Missing tables are cached too, as the empty blob
+        hb_blob_t *blob = hb_blob_get_empty();
+        if (data) {
+            rehb_native_table_handle *table = new rehb_native_table_handle();
+            table->releaseTable = tables->releaseTable;
+            table->handle = handle;
+            blob = hb_blob_create((const char *)data, (unsigned int)length,
+                                  HB_MEMORY_MODE_READONLY, table,
+                                  release_native_table);
+            hb_blob_make_immutable(blob);
+        }
+
+        tables->tables[tag] = blob;
+        return hb_blob_reference(blob);
+    }
+
+    static void destroy_native_tables(void *user_data) {
+        rehb_native_tables *tables = (rehb_native_tables *)user_data;
+        for (auto &entry : tables->tables) {
+            hb_blob_destroy(entry.second);
+        }
+        tables->releaseSource(tables->source);
+        delete tables;
+    }
+
+    CAMLprim value rehb_face_create_for_native_tables(value vSource,
+            value vCopyTable,
+            value vReleaseTable,
+            value vRetainSource,
+            value vReleaseSource) {
+        CAMLparam5(vSource, vCopyTable, vReleaseTable, vRetainSource,
+                   vReleaseSource);
+        CAMLlocal1(ret);
+
+        rehb_native_tables *tables = new rehb_native_tables();
+        tables->source = (void *)Nativeint_val(vSource);
+        tables->releaseSource =
+            (rehb_source_ref_func)Nativeint_val(vReleaseSource);
+        tables->copyTable = (rehb_copy_table_func)Nativeint_val(vCopyTable);
+        tables->releaseTable =
+            (rehb_release_table_func)Nativeint_val(vReleaseTable);
+        // Released in destroy_native_tables, which HarfBuzz also calls if
+        // the face can't be created
+        ((rehb_source_ref_func)Nativeint_val(vRetainSource))(tables->source);
+
+        hb_face_t *face = hb_face_create_for_tables(get_native_table, tables,
+                          destroy_native_tables);
+
+        hb_font_t *font = hb_font_create(face);
+        hb_face_destroy(face); // font keeps reference
+
+        hb_ot_font_set_funcs(font);
+
+        if (!font) {
+            ret = Val_error("Unable to create font from tables");
+        } else {
+            ret = Val_success(alloc_font_block(font, false));
         }
 
         CAMLreturn(ret);
@@ -44,4 +44,20 @@ void reason_skia_stub_matrix_set_scale(sk_matrix_t *matrix, double scaleX,
 
 
 void reason_skia_stub_rect_set(sk_rect_t *pRect, double left, double top,
-                               double right, double bottom);
\ No newline at end of file
+                               double right, double bottom);
+// Clone [typeface] at the given variation design coordinates - [axes] are
+// OpenType axis tags (ie, 'wght'). Returns NULL if the clone fails.
+// Implemented in typeface_variations.cpp.
+#ifdef __cplusplus
+extern "C" {
+#endif
+sk_typeface_t *reason_skia_typeface_make_variation(sk_typeface_t *typeface,
+        const uint32_t *axes,
+        const float *values,
+        int count);
+
+// Takes a reference to [typeface], released with sk_typeface_unref
+void reason_skia_typeface_ref(sk_typeface_t *typeface);
+#ifdef __cplusplus
+}
+#endif
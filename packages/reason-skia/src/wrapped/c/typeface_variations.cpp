@@ -0,0 +1,30 @@
+#include "c_stubs.h"
+
+#include "include/core/SkFontArguments.h"
+#include "include/core/SkTypeface.h"
+
+#include <vector>
+
+sk_typeface_t *reason_skia_typeface_make_variation(sk_typeface_t *typeface,
+        const uint32_t *axes,
+        const float *values,
+        int count) {
+    std::vector<SkFontArguments::VariationPosition::Coordinate> coordinates(
+        count);
+    for (int i = 0; i < count; i++) {
+        coordinates[i].axis = axes[i];
+        coordinates[i].value = values[i];
+    }
+
+    SkFontArguments args;
+    args.setVariationDesignPosition({coordinates.data(), count});
+
+    // The clone shares the font data of [typeface]
+    sk_sp<SkTypeface> clone =
+        reinterpret_cast<SkTypeface *>(typeface)->makeClone(args);
+    return reinterpret_cast<sk_typeface_t *>(clone.release());
+}
+
+void reason_skia_typeface_ref(sk_typeface_t *typeface) {
+    SkSafeRef(reinterpret_cast<SkTypeface *>(typeface));
+}
@@ -112,3 +112,96 @@ CAMLprim value reason_skia_stub_sk_color_set_argb_byte(value vAlpha, value vRed,
     return caml_copy_int32(reason_skia_stub_sk_color_set_argb(
                                Int32_val(vAlpha), Int32_val(vRed), Int32_val(vGreen), Int32_val(vBlue)));
 }
+
+/*
+ * Native table access for typefaces, so that other native libraries (ie,
+ * HarfBuzz) can load font tables without calling back into OCaml.
+ *
+ * [reason_skia_typeface_copy_table] returns a pointer to the table data,
+ * which stays valid until [reason_skia_typeface_release_table] is called
+ * with the returned [handle].
+ */
+static const void *reason_skia_typeface_copy_table(void *typeface,
+        uint32_t tag,
+        size_t *length,
+        void **handle) {
+    sk_data_t *data =
+        sk_typeface_copy_table_data((sk_typeface_t *)typeface, tag);
+
+    if (!data) {
+        *length = 0;
+        *handle = NULL;
+        return NULL;
+    }
+
+    *length = sk_data_get_size(data);
+    *handle = data;
+    return sk_data_get_data(data);
+}
+
+static void reason_skia_typeface_release_table(void *handle) {
+    sk_data_unref((sk_data_t *)handle);
+}
+
+/*
+ * References to the typeface itself, so native code loading its tables
+ * lazily can keep it alive.
+ */
+static void reason_skia_typeface_retain(void *typeface) {
+    reason_skia_typeface_ref((sk_typeface_t *)typeface);
+}
+
+static void reason_skia_typeface_release(void *typeface) {
+    sk_typeface_unref((sk_typeface_t *)typeface);
+}
+
+CAMLprim value reason_skia_typeface_table_funcs(value vUnit) {
+    CAMLparam1(vUnit);
+    CAMLlocal5(ret, vCopy, vRelease, vRetainTypeface, vReleaseTypeface);
+
+    vCopy = caml_copy_nativeint((intnat)&reason_skia_typeface_copy_table);
+    vRelease = caml_copy_nativeint((intnat)&reason_skia_typeface_release_table);
+    vRetainTypeface = caml_copy_nativeint((intnat)&reason_skia_typeface_retain);
+    vReleaseTypeface =
+        caml_copy_nativeint((intnat)&reason_skia_typeface_release);
+
+    ret = caml_alloc_tuple(4);
+    Store_field(ret, 0, vCopy);
+    Store_field(ret, 1, vRelease);
+    Store_field(ret, 2, vRetainTypeface);
+    Store_field(ret, 3, vReleaseTypeface);
+    CAMLreturn(ret);
+}
+
+// Fills the glyphs and positions of a run allocated with
+// sk_textblob_builder_alloc_run_pos from shaping results: [vGlyphIds] is an
+// int array, the others float arrays of the same length, in font units
+// scaled by [scale]. Glyphs start at ([baselineX], [baselineY]).
+CAMLprim value reason_skia_textblob_fill_run_pos(intnat glyphs, intnat pos,
+                                                value vGlyphIds,
+                                                value vXAdvances,
+                                                value vXOffsets,
+                                                value vYOffsets, double scale,
+                                                double baselineX,
+                                                double baselineY) {
+    uint16_t *pGlyphs = (uint16_t *)glyphs;
+    float *pPos = (float *)pos;
+    mlsize_t count = Wosize_val(vGlyphIds);
+
+    double x = baselineX;
+    for (mlsize_t i = 0; i < count; i++) {
+        pGlyphs[i] = (uint16_t)Long_val(Field(vGlyphIds, i));
+        pPos[2 * i] = (float)(x + Double_flat_field(vXOffsets, i) * scale);
+        pPos[2 * i + 1] =
+            (float)(baselineY + Double_flat_field(vYOffsets, i) * scale);
+        x += Double_flat_field(vXAdvances, i) * scale;
+    }
+    return Val_unit;
+}
+
+CAMLprim value reason_skia_textblob_fill_run_pos_byte(value *argv, int argn) {
+    return reason_skia_textblob_fill_run_pos(
+        Nativeint_val(argv[0]), Nativeint_val(argv[1]), argv[2], argv[3],
+        argv[4], argv[5], Double_val(argv[6]), Double_val(argv[7]),
+        Double_val(argv[8]));
+}